@@ -26,6 +26,7 @@
 #include "v4l2source.h"
 #include <QThread>
 #include <QtDebug>
+#include <algorithm>
 
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
@@ -36,9 +37,12 @@
 #include <glib-object.h>
 #include <gst/allocators/gstdmabuf.h>
 #include <gst/video/gstvideometa.h>
+#include <gst/video/video.h>
 
 #define MAX_ATTRIBUTES_COUNT 30
 
+// GStreamer names formats by byte order in memory, DRM by a little endian
+// packed word, so the component order of packed RGB formats is reversed
 static int gst_video_format_to_drm_code(GstVideoFormat format)
 {
     switch (format) {
@@ -55,35 +59,35 @@ static int gst_video_format_to_drm_code(GstVideoFormat format)
     case GST_VIDEO_FORMAT_YUY2:
         return DRM_FORMAT_YUYV;
     case GST_VIDEO_FORMAT_YV12:
-        return DRM_FORMAT_YVU422;
+        return DRM_FORMAT_YVU420;
     case GST_VIDEO_FORMAT_RGB:
-        return DRM_FORMAT_RGB888;
-    case GST_VIDEO_FORMAT_BGR:
         return DRM_FORMAT_BGR888;
+    case GST_VIDEO_FORMAT_BGR:
+        return DRM_FORMAT_RGB888;
     case GST_VIDEO_FORMAT_ARGB:
-        return DRM_FORMAT_ARGB8888;
+        return DRM_FORMAT_BGRA8888;
     case GST_VIDEO_FORMAT_RGBA:
-        return DRM_FORMAT_RGBA8888;
+        return DRM_FORMAT_ABGR8888;
     case GST_VIDEO_FORMAT_xRGB:
-        return DRM_FORMAT_XBGR8888;
-    case GST_VIDEO_FORMAT_BGRx:
         return DRM_FORMAT_BGRX8888;
+    case GST_VIDEO_FORMAT_BGRx:
+        return DRM_FORMAT_XRGB8888;
     case GST_VIDEO_FORMAT_GRAY8:
         return DRM_FORMAT_R8;
-    case GST_VIDEO_FORMAT_I420_10LE:
-        return DRM_FORMAT_YUV420;
     default:
-        qCritical() << "Unsupported format";
+        break;
     }
     return 0;
 }
 
+// Qt names 32-bit RGB formats by a native endian word, GStreamer by byte
+// order in memory, so like the DRM mapping this assumes little endian
 static QVideoFrame::PixelFormat
 gst_video_format_to_qvideoformat(GstVideoFormat format)
 {
     switch (format) {
     case GST_VIDEO_FORMAT_I420:
-        return QVideoFrame::PixelFormat::Format_IMC3;
+        return QVideoFrame::PixelFormat::Format_YUV420P;
     case GST_VIDEO_FORMAT_NV12:
         return QVideoFrame::PixelFormat::Format_NV12;
     case GST_VIDEO_FORMAT_UYVY:
@@ -97,21 +101,28 @@ gst_video_format_to_qvideoformat(GstVideoFormat format)
     case GST_VIDEO_FORMAT_BGR:
         return QVideoFrame::PixelFormat::Format_BGR24;
     case GST_VIDEO_FORMAT_ARGB:
-        return QVideoFrame::PixelFormat::Format_ARGB32;
-    case GST_VIDEO_FORMAT_RGBA:
-        return QVideoFrame::PixelFormat::Format_RGB32;
+        return QVideoFrame::PixelFormat::Format_BGRA32;
     case GST_VIDEO_FORMAT_xRGB:
-        return QVideoFrame::PixelFormat::Format_ARGB32;
-    case GST_VIDEO_FORMAT_BGRx:
         return QVideoFrame::PixelFormat::Format_BGR32;
+    case GST_VIDEO_FORMAT_BGRx:
+        return QVideoFrame::PixelFormat::Format_RGB32;
     case GST_VIDEO_FORMAT_GRAY8:
         return QVideoFrame::PixelFormat::Format_Y8;
     default:
-        qCritical() << "Unsupported format";
+        break;
     }
     return QVideoFrame::PixelFormat::Format_Invalid;
 }
 
+// Formats gst_video_format_to_qvideoformat() knows about, i.e. the ones
+// videoconvert may be asked to produce for the surface
+static const GstVideoFormat known_formats[] = {
+    GST_VIDEO_FORMAT_I420, GST_VIDEO_FORMAT_NV12, GST_VIDEO_FORMAT_UYVY,
+    GST_VIDEO_FORMAT_YUY2, GST_VIDEO_FORMAT_YV12, GST_VIDEO_FORMAT_RGB,
+    GST_VIDEO_FORMAT_BGR,  GST_VIDEO_FORMAT_ARGB, GST_VIDEO_FORMAT_xRGB,
+    GST_VIDEO_FORMAT_BGRx, GST_VIDEO_FORMAT_GRAY8,
+};
+
 #define GST_BUFFER_GET_DMAFD(buffer, plane)                                    \
     (((plane) < gst_buffer_n_memory((buffer))) ?                               \
          gst_dmabuf_memory_get_fd(gst_buffer_peek_memory((buffer), (plane))) : \
@@ -136,8 +147,13 @@ public:
         attribs[idx++] = m_videoMeta->width;
         attribs[idx++] = EGL_HEIGHT;
         attribs[idx++] = m_videoMeta->height;
+        int fourcc = gst_video_format_to_drm_code(m_videoMeta->format);
+        if (!fourcc) {
+            qCritical() << "Unsupported format";
+        }
+
         attribs[idx++] = EGL_LINUX_DRM_FOURCC_EXT;
-        attribs[idx++] = gst_video_format_to_drm_code(m_videoMeta->format);
+        attribs[idx++] = fourcc;
         attribs[idx++] = EGL_DMA_BUF_PLANE0_FD_EXT;
         attribs[idx++] = GST_BUFFER_GET_DMAFD(buffer, 0);
         attribs[idx++] = EGL_DMA_BUF_PLANE0_OFFSET_EXT;
@@ -293,8 +309,6 @@ private:
     GstMapInfo m_mapInfo[4];
 };
 
-static gboolean bus_call(GstBus* bus, GstMessage* msg, gpointer data);
-
 GstAppSinkCallbacks V4L2Source::callbacks = {.eos = nullptr,
                                              .new_preroll = nullptr,
                                              .new_sample =
@@ -316,22 +330,35 @@ appsink_pad_probe(GstPad* pad, GstPadProbeInfo* info, gpointer user_data)
 V4L2Source::V4L2Source(QQuickItem* parent) : QQuickItem(parent)
 {
     m_surface = nullptr;
+    m_path = NoPath;
+    m_pathReason = "not started";
+    m_importableKnown = false;
+    m_startPending = false;
     connect(this, &QQuickItem::windowChanged, this, &V4L2Source::setWindow);
 
     pipeline = gst_pipeline_new("V4L2Source::pipeline");
     v4l2src = gst_element_factory_make("v4l2src", nullptr);
+    capsfilter = gst_element_factory_make("capsfilter", nullptr);
+    convert = gst_element_factory_make("videoconvert", nullptr);
     appsink = gst_element_factory_make("appsink", nullptr);
 
     GstPad* pad = gst_element_get_static_pad(appsink, "sink");
     gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_QUERY_BOTH, appsink_pad_probe,
                       nullptr, nullptr);
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                      &V4L2Source::on_sink_caps, this, nullptr);
     gst_object_unref(pad);
 
     gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, this,
                                nullptr);
 
-    gst_bin_add_many(GST_BIN(pipeline), v4l2src, appsink, nullptr);
-    gst_element_link(v4l2src, appsink);
+    // videoconvert stays in the bin and is only linked in when negotiate()
+    // picks the converted path
+    gst_bin_add_many(GST_BIN(pipeline), v4l2src, capsfilter, appsink, nullptr);
+    if (convert) {
+        gst_bin_add(GST_BIN(pipeline), convert);
+    }
+    gst_element_link_many(v4l2src, capsfilter, appsink, nullptr);
 
     context = g_main_context_new();
     loop = g_main_loop_new(context, FALSE);
@@ -351,14 +378,7 @@ void V4L2Source::setVideoSurface(QAbstractVideoSurface* surface)
         m_surface->stop();
     }
     m_surface = surface;
-    if (surface
-            ->supportedPixelFormats(
-                QAbstractVideoBuffer::HandleType::EGLImageHandle)
-            .size() > 0) {
-        EGLImageSupported = true;
-    } else {
-        EGLImageSupported = false;
-    }
+    m_zeroCopyError.clear();
 
     if (m_surface && m_device.length() > 0) {
         start();
@@ -368,14 +388,24 @@ void V4L2Source::setVideoSurface(QAbstractVideoSurface* surface)
 void V4L2Source::setDevice(QString device)
 {
     m_device = device;
+    m_zeroCopyError.clear();
     if (m_surface && m_device.length() > 0) {
         start();
     }
 }
 
-static gboolean bus_call(GstBus* bus, GstMessage* msg, gpointer data)
+void V4L2Source::setCaps(QString caps)
 {
-    GMainLoop* loop = (GMainLoop*)data;
+    m_caps = caps;
+    if (m_surface && m_device.length() > 0) {
+        start();
+    }
+}
+
+gboolean V4L2Source::bus_call(GstBus* bus, GstMessage* msg, gpointer data)
+{
+    V4L2Source* self = (V4L2Source*)data;
+    GMainLoop* loop = self->loop;
 
     switch (GST_MESSAGE_TYPE(msg)) {
 
@@ -392,6 +422,11 @@ static gboolean bus_call(GstBus* bus, GstMessage* msg, gpointer data)
         g_free(debug);
 
         qWarning() << "Error: " << error->message;
+        // negotiation state belongs to the GUI thread
+        QString message = error->message;
+        QMetaObject::invokeMethod(
+            self, [self, message]() { self->streamFailed(message); },
+            Qt::QueuedConnection);
         g_error_free(error);
 
         g_main_loop_quit(loop);
@@ -404,15 +439,352 @@ static gboolean bus_call(GstBus* bus, GstMessage* msg, gpointer data)
     return TRUE;
 }
 
+static const char* path_name(V4L2Source::Path path)
+{
+    switch (path) {
+    case V4L2Source::NoPath:
+        return "none";
+    case V4L2Source::ZeroCopy:
+        return "zero-copy";
+    case V4L2Source::Mapped:
+        return "mapped";
+    case V4L2Source::Converted:
+        return "converted";
+    }
+    return "unknown";
+}
+
+// DRM fourcc codes the context's EGL display can import from a linear dmabuf,
+// which is what v4l2 exports. Without EGL_EXT_image_dma_buf_import_modifiers
+// there is no way to ask, so every format with a fourcc is assumed importable.
+static QSet<int> egl_importable_drm_formats(QOpenGLContext* context)
+{
+    QSet<int> result;
+    // nativeHandle() doesn't need the context to be current
+    EGLDisplay dpy =
+        qvariant_cast<QEGLNativeContext>(context->nativeHandle()).display();
+    if (dpy == EGL_NO_DISPLAY) {
+        return result;
+    }
+
+    const QByteArray extensions = eglQueryString(dpy, EGL_EXTENSIONS);
+    if (!extensions.contains("EGL_EXT_image_dma_buf_import")) {
+        return result;
+    }
+
+    static PFNEGLQUERYDMABUFFORMATSEXTPROC eglQueryDmaBufFormatsEXT =
+        reinterpret_cast<PFNEGLQUERYDMABUFFORMATSEXTPROC>(
+            eglGetProcAddress("eglQueryDmaBufFormatsEXT"));
+    static PFNEGLQUERYDMABUFMODIFIERSEXTPROC eglQueryDmaBufModifiersEXT =
+        reinterpret_cast<PFNEGLQUERYDMABUFMODIFIERSEXTPROC>(
+            eglGetProcAddress("eglQueryDmaBufModifiersEXT"));
+
+    if (!extensions.contains("EGL_EXT_image_dma_buf_import_modifiers") ||
+        !eglQueryDmaBufFormatsEXT || !eglQueryDmaBufModifiersEXT) {
+        for (GstVideoFormat format : known_formats) {
+            if (int fourcc = gst_video_format_to_drm_code(format)) {
+                result.insert(fourcc);
+            }
+        }
+        return result;
+    }
+
+    EGLint n_formats = 0;
+    eglQueryDmaBufFormatsEXT(dpy, 0, nullptr, &n_formats);
+    QVector<EGLint> formats(n_formats);
+    eglQueryDmaBufFormatsEXT(dpy, n_formats, formats.data(), &n_formats);
+
+    for (EGLint fourcc : formats) {
+        EGLint n_modifiers = 0;
+        eglQueryDmaBufModifiersEXT(dpy, fourcc, 0, nullptr, nullptr,
+                                   &n_modifiers);
+        // no modifiers reported means only the implicit (linear) layout
+        if (n_modifiers == 0) {
+            result.insert(fourcc);
+            continue;
+        }
+        QVector<EGLuint64KHR> modifiers(n_modifiers);
+        eglQueryDmaBufModifiersEXT(dpy, fourcc, n_modifiers, modifiers.data(),
+                                   nullptr, &n_modifiers);
+        if (modifiers.contains(DRM_FORMAT_MOD_LINEAR)) {
+            result.insert(fourcc);
+        }
+    }
+    return result;
+}
+
+static void collect_formats(const GValue* value,
+                            QVector<GstVideoFormat>& formats)
+{
+    if (!value) {
+        return;
+    }
+    if (G_VALUE_HOLDS_STRING(value)) {
+        GstVideoFormat format =
+            gst_video_format_from_string(g_value_get_string(value));
+        if (format != GST_VIDEO_FORMAT_UNKNOWN && !formats.contains(format)) {
+            formats.append(format);
+        }
+    } else if (GST_VALUE_HOLDS_LIST(value)) {
+        for (guint i = 0; i < gst_value_list_get_size(value); i++) {
+            collect_formats(gst_value_list_get_value(value, i), formats);
+        }
+    }
+}
+
+static gsize frame_size(GstVideoFormat format, int width, int height)
+{
+    GstVideoInfo info;
+    gst_video_info_set_format(&info, format, width, height);
+    return info.size;
+}
+
+// Intersect keeping the order of caps, consumes both arguments
+static GstCaps* constrain_caps(GstCaps* caps, GstCaps* filter)
+{
+    GstCaps* result =
+        gst_caps_intersect_full(caps, filter, GST_CAPS_INTERSECT_FIRST);
+    gst_caps_unref(caps);
+    gst_caps_unref(filter);
+    return result;
+}
+
+struct FormatCandidate {
+    GstVideoFormat format; // produced by the device
+    GstVideoFormat target; // handed to the surface
+    V4L2Source::Path path;
+    gsize cost; // estimated bytes the CPU touches per frame, for ranking
+    QString reason;
+};
+
+// Report that no path could be set up, so results of a previous run don't
+// linger in the properties
+bool V4L2Source::failNegotiation(const QString& reason)
+{
+    qWarning() << "Negotiation failed:" << reason;
+    m_path = NoPath;
+    m_pathReason = reason;
+    m_negotiatedCaps.clear();
+    emit negotiated();
+    return false;
+}
+
+// Pick the device format that is cheapest to bring to the surface, honouring
+// the caps property, and configure the pipeline for it
+bool V4L2Source::negotiate()
+{
+    if (!m_surface) {
+        return failNegotiation("no video surface");
+    }
+
+    // device has to be opened to report what it can produce
+    if (gst_element_set_state(pipeline, GST_STATE_READY) ==
+        GST_STATE_CHANGE_FAILURE) {
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        return failNegotiation(QString("failed to open %1").arg(m_device));
+    }
+    GstPad* pad = gst_element_get_static_pad(v4l2src, "src");
+    GstCaps* caps = gst_pad_query_caps(pad, nullptr);
+    gst_object_unref(pad);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+
+    // compressed formats would need a decoder, leave them out
+    caps = constrain_caps(caps, gst_caps_new_empty_simple("video/x-raw"));
+
+    if (m_caps.length() > 0) {
+        GstCaps* user = gst_caps_from_string(m_caps.toStdString().c_str());
+        if (user) {
+            caps = constrain_caps(caps, user);
+        } else {
+            qWarning() << "Ignoring invalid caps" << m_caps;
+        }
+    }
+    if (gst_caps_is_empty(caps)) {
+        gst_caps_unref(caps);
+        return failNegotiation(
+            QString("%1 can't produce raw video matching \"%2\"")
+                .arg(m_device, m_caps));
+    }
+
+    // Only the format is chosen here. Size and rate are left to v4l2src,
+    // which fixates toward the device's current format within the caps
+    // property. Formats are ranked at the largest size of the first caps
+    // structure, on_sink_caps() reports the cost at the size that runs.
+    GstStructure* s = gst_structure_copy(gst_caps_get_structure(caps, 0));
+    gst_structure_fixate_field_nearest_int(s, "width", G_MAXINT);
+    gst_structure_fixate_field_nearest_int(s, "height", G_MAXINT);
+    int width = 0;
+    int height = 0;
+    gst_structure_get_int(s, "width", &width);
+    gst_structure_get_int(s, "height", &height);
+    gst_structure_free(s);
+
+    QVector<GstVideoFormat> formats;
+    for (guint i = 0; i < gst_caps_get_size(caps); i++) {
+        collect_formats(
+            gst_structure_get_value(gst_caps_get_structure(caps, i), "format"),
+            formats);
+    }
+
+    const QList<QVideoFrame::PixelFormat> eglFormats =
+        m_surface->supportedPixelFormats(
+            QAbstractVideoBuffer::HandleType::EGLImageHandle);
+    const QList<QVideoFrame::PixelFormat> memFormats =
+        m_surface->supportedPixelFormats(
+            QAbstractVideoBuffer::HandleType::NoHandle);
+    QSet<int> importable;
+    {
+        QMutexLocker locker(&mutex);
+        importable = m_importable;
+    }
+
+    QVector<FormatCandidate> candidates;
+    for (GstVideoFormat format : formats) {
+        const QString name = gst_video_format_to_string(format);
+        const QVideoFrame::PixelFormat qformat =
+            gst_video_format_to_qvideoformat(format);
+        const int fourcc = gst_video_format_to_drm_code(format);
+        const gsize bytes = frame_size(format, width, height);
+        const bool gray =
+            GST_VIDEO_FORMAT_INFO_IS_GRAY(gst_video_format_get_info(format));
+
+        // smallest format the surface maps, used when conversion is needed.
+        // Colour sources must not be converted to gray and lose chroma.
+        GstVideoFormat target = GST_VIDEO_FORMAT_UNKNOWN;
+        gsize targetSize = 0;
+        for (GstVideoFormat candidate : known_formats) {
+            if (!convert ||
+                !memFormats.contains(
+                    gst_video_format_to_qvideoformat(candidate)) ||
+                (!gray && GST_VIDEO_FORMAT_INFO_IS_GRAY(
+                              gst_video_format_get_info(candidate)))) {
+                continue;
+            }
+            gsize candidateSize = frame_size(candidate, width, height);
+            if (target == GST_VIDEO_FORMAT_UNKNOWN ||
+                candidateSize < targetSize) {
+                target = candidate;
+                targetSize = candidateSize;
+            }
+        }
+
+        QString why;
+        if (eglFormats.isEmpty()) {
+            why = "surface has no EGLImage support";
+        } else if (m_zeroCopyError.length() > 0) {
+            why = QString("zero-copy failed: %1").arg(m_zeroCopyError);
+        } else if (!fourcc) {
+            why = QString("%1 has no DRM fourcc").arg(name);
+        } else if (!importable.contains(fourcc)) {
+            why = QString("EGL can't import %1 dmabufs").arg(name);
+        } else if (!eglFormats.contains(qformat)) {
+            why = QString("surface doesn't accept %1 EGLImages").arg(name);
+        }
+
+        if (why.isEmpty()) {
+            candidates.append(
+                {format, format, ZeroCopy, 0,
+                 QString("%1 dmabufs are imported as EGLImages").arg(name)});
+        } else if (memFormats.contains(qformat)) {
+            candidates.append(
+                {format, format, Mapped, bytes,
+                 QString("%1, mapping %2 buffers").arg(why, name)});
+        } else if (target != GST_VIDEO_FORMAT_UNKNOWN) {
+            // videoconvert reads the frame and writes the target which the
+            // surface then uploads
+            candidates.append(
+                {format, target, Converted, bytes + 2 * targetSize,
+                 QString("%1, surface doesn't accept %2, converting to %3")
+                     .arg(why, name, gst_video_format_to_string(target))});
+        }
+    }
+
+    if (candidates.isEmpty()) {
+        gst_caps_unref(caps);
+        return failNegotiation(
+            QString("no format of %1 can be displayed by the surface")
+                .arg(m_device));
+    }
+
+    // stable, so equal costs keep the device's preference
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const FormatCandidate& a, const FormatCandidate& b) {
+                         return a.cost < b.cost;
+                     });
+    const FormatCandidate& best = candidates.first();
+
+    GstCaps* source = constrain_caps(
+        caps,
+        gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING,
+                            gst_video_format_to_string(best.format), nullptr));
+    // videoconvert keeps the size, so only the format is asked of it
+    GstCaps* sink = best.path == Converted ?
+                        gst_caps_new_simple(
+                            "video/x-raw", "format", G_TYPE_STRING,
+                            gst_video_format_to_string(best.target), nullptr) :
+                        gst_caps_ref(source);
+    g_object_set(capsfilter, "caps", source, nullptr);
+    g_object_set(appsink, "caps", sink, nullptr);
+    gst_caps_unref(sink);
+
+    // io-mode 4 is dmabuf, 0 lets v4l2src decide
+    g_object_set(v4l2src, "io-mode", best.path == ZeroCopy ? 4 : 0, nullptr);
+
+    gst_element_unlink(capsfilter, appsink);
+    if (convert) {
+        gst_element_unlink(capsfilter, convert);
+        gst_element_unlink(convert, appsink);
+    }
+    if (best.path == Converted) {
+        gst_element_link_many(capsfilter, convert, appsink, nullptr);
+    } else {
+        gst_element_link(capsfilter, appsink);
+    }
+
+    gst_caps_unref(source);
+    // negotiatedCaps is filled in by on_sink_caps() once caps are fixed
+    m_negotiatedCaps.clear();
+    m_path = best.path;
+    m_selectionReason = best.reason;
+    m_pathReason = best.reason;
+
+    qInfo() << "Selected" << path_name(m_path) << "path:" << m_pathReason;
+    emit negotiated();
+    return true;
+}
+
 void V4L2Source::run()
 {
     g_main_context_push_thread_default(g_main_loop_get_context(loop));
     GstBus* bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
-    gst_bus_add_watch(bus, bus_call, loop);
-    gst_object_unref(bus);
+    gst_bus_add_watch(bus, &V4L2Source::bus_call, this);
     gst_element_set_state(pipeline, GST_STATE_PLAYING);
     g_main_loop_run(loop);
     gst_element_set_state(pipeline, GST_STATE_NULL);
+    // a bus takes a single watch, the next run adds its own
+    gst_bus_remove_watch(bus);
+    gst_object_unref(bus);
+}
+
+// With io-mode dmabuf v4l2src posts an error instead of falling back when
+// the driver can't export buffers, so a failed zero-copy run is negotiated
+// again without zero-copy. Other failures just end the stream.
+void V4L2Source::streamFailed(const QString& error)
+{
+    // stop() consumes the future, nothing to recover after an explicit stop
+    if (!worker_handle.valid()) {
+        return;
+    }
+    if (m_path != ZeroCopy) {
+        failNegotiation(QString("stream failed: %1").arg(error));
+        return;
+    }
+    m_zeroCopyError = error;
+    m_path = NoPath;
+    m_pathReason = QString("zero-copy failed: %1").arg(error);
+    m_negotiatedCaps.clear();
+    emit negotiated();
+    start();
 }
 
 void V4L2Source::start()
@@ -421,10 +793,37 @@ void V4L2Source::start()
         stop();
     }
 
+    // the negotiated format may differ from the one the surface runs with
+    if (m_surface && m_surface->isActive()) {
+        m_surface->stop();
+    }
+
+    // Zero-copy candidates have to be checked against the display Qt Quick
+    // renders with, which is only known once the scene graph is initialized.
+    // queryEGL() starts again then.
+    bool importableKnown;
+    {
+        QMutexLocker locker(&mutex);
+        importableKnown = m_importableKnown;
+    }
+    m_startPending = false;
+    if (!importableKnown && m_surface &&
+        !m_surface
+             ->supportedPixelFormats(
+                 QAbstractVideoBuffer::HandleType::EGLImageHandle)
+             .isEmpty()) {
+        m_startPending = true;
+        m_path = NoPath;
+        m_pathReason = "waiting for the scene graph to be initialized";
+        m_negotiatedCaps.clear();
+        emit negotiated();
+        return;
+    }
+
     g_object_set(v4l2src, "device", m_device.toStdString().c_str(), nullptr);
 
-    if (EGLImageSupported) {
-        g_object_set(v4l2src, "io-mode  ", 4, nullptr);
+    if (!negotiate()) {
+        return;
     }
 
     worker_handle = std::async(std::launch::async, &V4L2Source::run, this);
@@ -432,9 +831,15 @@ void V4L2Source::start()
 
 void V4L2Source::stop()
 {
+    // nothing to stop if start() never launched a worker or failed to
+    // negotiate, waiting on an empty future would throw
+    if (!worker_handle.valid()) {
+        return;
+    }
     GstBus* bus = gst_element_get_bus(GST_ELEMENT(pipeline));
     bool ret = gst_bus_post(bus, gst_message_new_eos(GST_OBJECT(pipeline)));
-    worker_handle.wait();
+    // get() releases the shared state, so stopping twice is a no-op
+    worker_handle.get();
     g_clear_pointer(&bus, gst_object_unref);
 }
 
@@ -443,19 +848,34 @@ void V4L2Source::setWindow(QQuickWindow* win)
     if (win) {
         connect(win, &QQuickWindow::beforeSynchronizing, this,
                 &V4L2Source::sync, Qt::DirectConnection);
+        connect(
+            win, &QQuickWindow::sceneGraphInitialized, this,
+            [this, win]() { queryEGL(win->openglContext()); },
+            Qt::DirectConnection);
+        if (win->openglContext()) {
+            queryEGL(win->openglContext());
+        }
     }
 }
 
-static bool buffer_is_dmabuf(GstBuffer* buffer)
+// Called from the render thread when the scene graph is initialized, or from
+// the GUI thread if the window already had a context
+void V4L2Source::queryEGL(QOpenGLContext* context)
 {
-    guint n_mem = gst_buffer_n_memory(buffer);
-    for (guint i = 0; i < n_mem; i++) {
-        GstMemory* memory = gst_buffer_peek_memory(buffer, 0);
-        if (!gst_is_dmabuf_memory(memory)) {
-            return false;
-        }
+    QSet<int> importable = egl_importable_drm_formats(context);
+    {
+        QMutexLocker locker(&mutex);
+        m_importable = importable;
+        m_importableKnown = true;
     }
-    return true;
+    QMetaObject::invokeMethod(
+        this,
+        [this]() {
+            if (m_startPending) {
+                start();
+            }
+        },
+        Qt::QueuedConnection);
 }
 
 // Make sure this callback is invoked from rendering thread
@@ -475,10 +895,17 @@ void V4L2Source::sync()
     GstBuffer* buffer = gst_sample_get_buffer(sample);
     GstVideoMeta* videoMeta = gst_buffer_get_video_meta(buffer);
 
-    // if memory is DMABUF and EGLImage is supported by the backend,
-    // create video buffer with EGLImage handle
+    QSize size = QSize(videoMeta->width, videoMeta->height);
+    QVideoFrame::PixelFormat format =
+        gst_video_format_to_qvideoformat(videoMeta->format);
+    if (format == QVideoFrame::PixelFormat::Format_Invalid) {
+        qCritical() << "Unsupported format";
+    }
+
+    // with zero-copy negotiated v4l2src runs in dmabuf io-mode and only
+    // delivers DMABUF memory, so create video buffer with EGLImage handle
     videoFrame.reset();
-    if (EGLImageSupported && buffer_is_dmabuf(buffer)) {
+    if (m_path == ZeroCopy) {
         videoBuffer.reset(new GstDmaVideoBuffer(buffer, videoMeta));
     } else {
         // TODO: support other memory types, probably GL textures?
@@ -486,21 +913,87 @@ void V4L2Source::sync()
         videoBuffer.reset(new GstVideoBuffer(buffer, videoMeta));
     }
 
-    QSize size = QSize(videoMeta->width, videoMeta->height);
-    QVideoFrame::PixelFormat format =
-        gst_video_format_to_qvideoformat(videoMeta->format);
-
     videoFrame.reset(new QVideoFrame(
         static_cast<QAbstractVideoBuffer*>(videoBuffer.get()), size, format));
 
     if (!m_surface->isActive()) {
-        m_format = QVideoSurfaceFormat(size, format);
-        Q_ASSERT(m_surface->start(m_format) == true);
+        m_format =
+            QVideoSurfaceFormat(size, format, videoBuffer->handleType());
+        bool started = m_surface->start(m_format);
+        Q_ASSERT(started);
+        Q_UNUSED(started)
     }
     m_surface->present(*videoFrame);
     gst_sample_unref(sample);
 }
 
+// Report the caps the pipeline settled on and what a frame of that size
+// costs on the negotiated path
+GstPadProbeReturn
+V4L2Source::on_sink_caps(GstPad* pad, GstPadProbeInfo* info, gpointer data)
+{
+    Q_UNUSED(pad)
+    GstEvent* event = gst_pad_probe_info_get_event(info);
+    if (GST_EVENT_TYPE(event) != GST_EVENT_CAPS) {
+        return GST_PAD_PROBE_OK;
+    }
+    V4L2Source* self = (V4L2Source*)data;
+    GstCaps* caps;
+    gst_event_parse_caps(event, &caps);
+    GstVideoInfo sinkInfo;
+    if (!gst_video_info_from_caps(&sinkInfo, caps)) {
+        return GST_PAD_PROBE_OK;
+    }
+
+    // m_path is only written while no worker is running
+    gsize cost = 0;
+    if (self->m_path == Mapped) {
+        cost = sinkInfo.size;
+    } else if (self->m_path == Converted) {
+        // videoconvert reads the device frame and writes the one the
+        // surface then uploads
+        GstPad* src = gst_element_get_static_pad(self->capsfilter, "src");
+        GstCaps* sourceCaps = gst_pad_get_current_caps(src);
+        GstVideoInfo sourceInfo;
+        if (sourceCaps && gst_video_info_from_caps(&sourceInfo, sourceCaps)) {
+            cost = sourceInfo.size;
+        }
+        if (sourceCaps) {
+            gst_caps_unref(sourceCaps);
+        }
+        gst_object_unref(src);
+        cost += 2 * sinkInfo.size;
+    }
+
+    gchar* str = gst_caps_to_string(caps);
+    QString negotiatedCaps = str;
+    g_free(str);
+    int width = GST_VIDEO_INFO_WIDTH(&sinkInfo);
+    int height = GST_VIDEO_INFO_HEIGHT(&sinkInfo);
+
+    QMetaObject::invokeMethod(
+        self,
+        [self, negotiatedCaps, cost, width, height]() {
+            // the run may have failed in the meantime
+            if (self->m_path == NoPath) {
+                return;
+            }
+            self->m_negotiatedCaps = negotiatedCaps;
+            self->m_pathReason =
+                QString("%1 (%2 bytes copied per frame at %3x%4)")
+                    .arg(self->m_selectionReason)
+                    .arg(cost)
+                    .arg(width)
+                    .arg(height);
+            qInfo() << "Negotiated" << self->m_negotiatedCaps << "using"
+                    << path_name(self->m_path)
+                    << "path:" << self->m_pathReason;
+            emit self->negotiated();
+        },
+        Qt::QueuedConnection);
+    return GST_PAD_PROBE_OK;
+}
+
 GstFlowReturn V4L2Source::on_new_sample(GstAppSink* sink, gpointer data)
 {
     Q_UNUSED(sink)
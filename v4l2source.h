@@ -29,6 +29,7 @@
 #include <QMutex>
 #include <QQuickItem>
 #include <QQuickWindow>
+#include <QSet>
 #include <QThread>
 #include <QVideoSurfaceFormat>
 
@@ -43,14 +44,27 @@ class V4L2Source : public QQuickItem
     Q_PROPERTY(QAbstractVideoSurface* videoSurface READ videoSurface WRITE
                    setVideoSurface)
     Q_PROPERTY(QString device MEMBER m_device READ device WRITE setDevice)
-    Q_PROPERTY(QString caps MEMBER m_caps)
+    Q_PROPERTY(QString caps MEMBER m_caps READ caps WRITE setCaps)
+    Q_PROPERTY(Path path READ path NOTIFY negotiated)
+    Q_PROPERTY(QString pathReason READ pathReason NOTIFY negotiated)
+    Q_PROPERTY(QString negotiatedCaps READ negotiatedCaps NOTIFY negotiated)
 
 public:
+    // How frames get from v4l2src to the surface
+    enum Path {
+        NoPath,    // not negotiated yet or negotiation failed
+        ZeroCopy,  // dmabuf imported as EGLImage
+        Mapped,    // buffer memory mapped and uploaded by the surface
+        Converted, // videoconvert into a format the surface accepts
+    };
+    Q_ENUM(Path)
+
     V4L2Source(QQuickItem* parent = nullptr);
     virtual ~V4L2Source();
 
     void setVideoSurface(QAbstractVideoSurface* surface);
     void setDevice(QString device);
+    void setCaps(QString caps);
 
 public slots:
     void start();
@@ -62,6 +76,7 @@ private slots:
 
 signals:
     void frameReady();
+    void negotiated();
 
 protected:
     QAbstractVideoSurface* videoSurface() const
@@ -74,9 +89,37 @@ protected:
         return m_device;
     }
 
+    QString caps() const
+    {
+        return m_caps;
+    }
+
+    Path path() const
+    {
+        return m_path;
+    }
+
+    QString pathReason() const
+    {
+        return m_pathReason;
+    }
+
+    QString negotiatedCaps() const
+    {
+        return m_negotiatedCaps;
+    }
+
 private:
+    void queryEGL(QOpenGLContext* context);
+    bool negotiate();
+    bool failNegotiation(const QString& reason);
+    void streamFailed(const QString& error);
     void run();
     GstFlowReturn static on_new_sample(GstAppSink* sink, gpointer data);
+    gboolean static bus_call(GstBus* bus, GstMessage* msg, gpointer data);
+    GstPadProbeReturn static on_sink_caps(GstPad* pad,
+                                          GstPadProbeInfo* info,
+                                          gpointer data);
 
     static GstAppSinkCallbacks callbacks;
 
@@ -84,9 +127,13 @@ private:
     QAbstractVideoSurface* m_surface;
     QString m_device;
     QString m_caps;
+    Path m_path;
+    QString m_pathReason;
+    QString m_negotiatedCaps;
+    // why the path was picked, pathReason adds the cost once caps are fixed
+    QString m_selectionReason;
 
     // state:
-    bool EGLImageSupported;
     int fd;
     bool ready;
     QVideoSurfaceFormat m_format;
@@ -94,11 +141,19 @@ private:
     QSharedPointer<QVideoFrame> videoFrame;
     QMutex mutex;
     std::future<void> worker_handle;
+    // DRM fourcc codes the scene graph's EGL display imports, guarded by mutex
+    QSet<int> m_importable;
+    bool m_importableKnown;
+    bool m_startPending;
+    // why zero-copy failed on this device, excludes it from negotiation
+    QString m_zeroCopyError;
 
     GMainContext* context;
     GMainLoop* loop;
     GstElement* pipeline;
     GstElement* v4l2src;
+    GstElement* capsfilter;
+    GstElement* convert;
     GstElement* appsink;
 };
 